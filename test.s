@@ -16,3 +16,8 @@ repeat 10
 ldf a,label
 label: .equ flt{3.14}
 ldf a,flt{enfloat(:label)*2}
+x 1,2
+jp nz,5
+mov byte 3
+u q7
+mo